@@ -6,6 +6,11 @@ LOCAL_MODULE    := pirovera
 LOCAL_SRC_FILES := pirovera.c net.c control.c
 LOCAL_SHARED_LIBRARIES := gstreamer_android
 LOCAL_LDLIBS := -llog -landroid
+# ndk-build PIROVERA_LATENCY=1 to measure command to photon latency against sim/roversim
+ifdef PIROVERA_LATENCY
+LOCAL_SRC_FILES += latency.c
+LOCAL_CFLAGS += -DPIROVERA_LATENCY
+endif
 include $(BUILD_SHARED_LIBRARY)
 
 ifndef GSTREAMER_ROOT
@@ -26,17 +26,39 @@ signed short motors[4] = {0,0,0,0};
 unsigned short lights = 0;
 unsigned short flags = 0;
 
+/* Recent motor changes, recorded as they happen for latency measurement */
+static ControlChange changes[CONTROL_CHANGES];
+static guint n_changes = 0;
+
 static GMutex control_mutex;
 
+/* Call with control_mutex held, after updating motors */
+static void record_change(void)
+{
+    ControlChange *c = &changes[n_changes % CONTROL_CHANGES];
+
+    c->left = motors[1];
+    c->right = motors[0];
+    c->time = g_get_monotonic_time ();
+    n_changes++;
+}
+
 void control_set_motors(signed short *m)
 {
+    gboolean changed;
+
     g_mutex_lock (&control_mutex);
 
+    changed = motors[0] != m[0] || motors[1] != m[1] || motors[2] != m[2] || motors[3] != m[3];
+
     motors[0] = m[0];
     motors[1] = m[1];
     motors[2] = m[2];
     motors[3] = m[3];
 
+    if (changed)
+        record_change();
+
     g_mutex_unlock (&control_mutex);
 }
 
@@ -96,19 +118,33 @@ void control_set_flags(signed short f)
 
 void control_set_left(signed short f)
 {
+    gboolean changed;
+
     g_mutex_lock (&control_mutex);
 
+    changed = motors[1] != f || motors[3] != f;
+
     motors[1] = motors[3] = f;
 
+    if (changed)
+        record_change();
+
     g_mutex_unlock (&control_mutex);
 }
 
 void control_set_right(signed short f)
 {
+    gboolean changed;
+
     g_mutex_lock (&control_mutex);
 
+    changed = motors[0] != f || motors[2] != f;
+
     motors[0] = motors[2] = f;
 
+    if (changed)
+        record_change();
+
     g_mutex_unlock (&control_mutex);
 }
 
@@ -135,4 +171,23 @@ void control_get_packet(char *buf)
     g_mutex_unlock (&control_mutex);
 }
 
+int control_get_changes(ControlChange *out, guint *serial)
+{
+    guint i;
+    int n = 0;
+
+    g_mutex_lock (&control_mutex);
 
+    /* Anything older than the ring has been overwritten */
+    i = *serial;
+    if (n_changes - i > CONTROL_CHANGES)
+        i = n_changes - CONTROL_CHANGES;
+
+    for (; i != n_changes; i++)
+        out[n++] = changes[i % CONTROL_CHANGES];
+    *serial = n_changes;
+
+    g_mutex_unlock (&control_mutex);
+
+    return n;
+}
@@ -11,3 +11,14 @@ void control_set_left(signed short f);
 void control_set_right(signed short f);
 
 void control_get_packet(char *buf);
+
+/* A change of motor values and when it happened */
+typedef struct {
+    signed short left, right;
+    gint64 time;
+} ControlChange;
+
+#define CONTROL_CHANGES 32
+
+/* Copy the changes made since *serial (at most CONTROL_CHANGES) into out, oldest first, and update *serial */
+int control_get_changes(ControlChange *out, guint *serial);
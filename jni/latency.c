@@ -0,0 +1,277 @@
+/* latency.c -- measure command to photon latency against the rover simulator
+ *
+ * Copyright (C) 2015 Alistair Buxton <a.j.buxton@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The simulator draws a marker whose position follows the motor values it receives (see marker.h). Motor
+ * changes are timestamped by control.c as they happen. Every decoded frame arriving at the video sink is
+ * searched for the marker, and when it moves to where a pending motor change says it should be, the time since
+ * the first change that put it there is recorded. Once enough samples are collected
+ * the distribution is written to the log, tagged with the send and pipeline modes in use.
+ *
+ * Frames are timed as they reach the sink, so display latency after that point is not included. Changes
+ * made while the stream is down would show up as one huge sample when it comes back, so the pending changes
+ * are thrown away whenever the stream restarts or frames stop for a while.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <android/log.h>
+
+#include "latency.h"
+#include "control.h"
+#include "net.h"
+#include "marker.h"
+
+/* Samples per reported distribution, enough for a meaningful p99 */
+#define LATENCY_REPORT_SAMPLES 500
+
+/* Motor changes waiting to show up on screen */
+#define LATENCY_PENDING CONTROL_CHANGES
+
+/* How far (in simulator pixels) the marker may be from where we expect it */
+#define LATENCY_TOLERANCE 3
+
+/* Luma above this is part of the marker */
+#define LATENCY_THRESHOLD 128
+
+/* Only look at every Nth pixel in each direction when searching for the marker */
+#define LATENCY_STEP 2
+
+/* A gap this long between frames means the stream dropped out */
+#define LATENCY_MAX_GAP_MS 250
+
+typedef struct {
+    int x, y;
+    gint64 time;
+} PendingChange;
+
+static GstPad *sink_pad = NULL;
+static gulong probe_id = 0;
+static const char *mode = NULL;
+
+static guint serial = 0;
+static PendingChange pending[LATENCY_PENDING];
+static int n_pending = 0;
+
+/* Where the marker was last seen on screen */
+static gboolean have_marker = FALSE;
+static int marker_seen_x, marker_seen_y;
+
+/* Set (atomically) to have the streaming thread start afresh with the next frame */
+static gint reset_requested = FALSE;
+static gint64 last_frame = 0;
+
+static gint64 samples[LATENCY_REPORT_SAMPLES];
+static int n_samples = 0;
+
+static gboolean warned = FALSE;
+
+static int compare_samples(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(void)
+{
+    qsort(samples, n_samples, sizeof(gint64), compare_samples);
+
+    __android_log_print(ANDROID_LOG_INFO, "PiRover",
+            "Command to photon latency (send=timer/%dms pipeline=%s, %d samples): "
+            "min %" G_GINT64_FORMAT " p50 %" G_GINT64_FORMAT " p90 %" G_GINT64_FORMAT
+            " p99 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT " ms",
+            NET_SEND_INTERVAL_MS, mode, n_samples,
+            samples[0] / 1000,
+            samples[n_samples / 2] / 1000,
+            samples[n_samples * 9 / 10] / 1000,
+            samples[n_samples * 99 / 100] / 1000,
+            samples[n_samples - 1] / 1000);
+
+    n_samples = 0;
+}
+
+static gboolean near(int x0, int y0, int x1, int y1)
+{
+    return abs(x0 - x1) <= LATENCY_TOLERANCE && abs(y0 - y1) <= LATENCY_TOLERANCE;
+}
+
+/* Forget what is pending and what is on screen, and skip the changes made so far. Streaming thread only. */
+static void reset(void)
+{
+    ControlChange changes[CONTROL_CHANGES];
+
+    control_get_changes(changes, &serial);
+    n_pending = 0;
+    have_marker = FALSE;
+}
+
+/* Queue the motor changes made since the last frame. Changes that wouldn't visibly move the marker from where
+ * it is, or will be once the pending changes arrive, can't be told apart on screen and are skipped. */
+static void poll_controls(void)
+{
+    ControlChange changes[CONTROL_CHANGES];
+    PendingChange c;
+    int i, n;
+
+    n = control_get_changes(changes, &serial);
+
+    for (i = 0; i < n; i++) {
+        c.x = marker_x(changes[i].left);
+        c.y = marker_y(changes[i].right);
+        c.time = changes[i].time;
+
+        if (n_pending > 0) {
+            if (near(c.x, c.y, pending[n_pending - 1].x, pending[n_pending - 1].y))
+                continue;
+        } else if (have_marker) {
+            if (near(c.x, c.y, marker_seen_x, marker_seen_y))
+                continue;
+        }
+
+        if (n_pending == LATENCY_PENDING) {
+            memmove(pending, pending + 1, (LATENCY_PENDING - 1) * sizeof(PendingChange));
+            n_pending--;
+        }
+        pending[n_pending++] = c;
+    }
+}
+
+/* Find the marker's top left corner, in simulator pixels */
+static gboolean find_marker(GstVideoFrame *frame, int *mx, int *my)
+{
+    const guint8 *luma = GST_VIDEO_FRAME_COMP_DATA(frame, 0);
+    int stride = GST_VIDEO_FRAME_COMP_STRIDE(frame, 0);
+    int width = GST_VIDEO_FRAME_COMP_WIDTH(frame, 0);
+    int height = GST_VIDEO_FRAME_COMP_HEIGHT(frame, 0);
+    int x, y, x0 = width, y0 = height, x1 = -1, y1 = -1;
+
+    for (y = 0; y < height; y += LATENCY_STEP) {
+        for (x = 0; x < width; x += LATENCY_STEP) {
+            if (luma[y * stride + x] > LATENCY_THRESHOLD) {
+                if (x < x0) x0 = x;
+                if (x > x1) x1 = x;
+                if (y < y0) y0 = y;
+                if (y > y1) y1 = y;
+            }
+        }
+    }
+
+    if (x1 < 0)
+        return FALSE;
+
+    /* Use the centre of the bounding box, it is less affected by sampling and compression noise */
+    *mx = (x0 + x1) * MARKER_FRAME_WIDTH / (2 * width) - MARKER_SIZE / 2;
+    *my = (y0 + y1) * MARKER_FRAME_HEIGHT / (2 * height) - MARKER_SIZE / 2;
+    return TRUE;
+}
+
+/* Runs in the streaming thread for every frame about to be rendered */
+static GstPadProbeReturn frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer unused)
+{
+    gint64 now = g_get_monotonic_time();
+    GstCaps *caps;
+    GstVideoInfo vinfo;
+    GstVideoFrame frame;
+    gboolean found;
+    int mx, my, i;
+
+    caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        return GST_PAD_PROBE_OK;
+    found = gst_video_info_from_caps(&vinfo, caps) && GST_VIDEO_INFO_IS_YUV(&vinfo);
+    gst_caps_unref(caps);
+
+    if (!found || !gst_video_frame_map(&frame, &vinfo, GST_PAD_PROBE_INFO_BUFFER(info), GST_MAP_READ)) {
+        if (!warned)
+            __android_log_print(ANDROID_LOG_WARN, "PiRover", "Can't read decoded frames, latency not measured.");
+        warned = TRUE;
+        return GST_PAD_PROBE_OK;
+    }
+
+    found = find_marker(&frame, &mx, &my);
+    gst_video_frame_unmap(&frame);
+
+    if (g_atomic_int_compare_and_exchange(&reset_requested, TRUE, FALSE)
+            || now - last_frame > LATENCY_MAX_GAP_MS * G_GINT64_CONSTANT(1000))
+        reset();
+    last_frame = now;
+
+    poll_controls();
+    if (!found)
+        return GST_PAD_PROBE_OK;
+
+    /* Only a frame where the marker has moved can show a new change */
+    if (have_marker && near(mx, my, marker_seen_x, marker_seen_y))
+        return GST_PAD_PROBE_OK;
+
+    /* The newest change the frame agrees with is the one it shows, older ones were overtaken. Changes that
+     * didn't move the marker were never queued, so its time is when this position was first commanded. */
+    for (i = n_pending - 1; have_marker && i >= 0; i--) {
+        if (near(mx, my, pending[i].x, pending[i].y)) {
+            samples[n_samples++] = now - pending[i].time;
+            memmove(pending, pending + i + 1, (n_pending - i - 1) * sizeof(PendingChange));
+            n_pending -= i + 1;
+            if (n_samples == LATENCY_REPORT_SAMPLES)
+                report();
+            break;
+        }
+    }
+
+    have_marker = TRUE;
+    marker_seen_x = mx;
+    marker_seen_y = my;
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Start watching the frames going into the video sink. Safe to call again with the same or a new pad. */
+void latency_attach(GstPad *pad, const char *pipeline_mode)
+{
+    if (pad == sink_pad)
+        return;
+
+    latency_detach();
+
+    mode = pipeline_mode;
+    sink_pad = gst_object_ref(pad);
+    g_atomic_int_set(&reset_requested, TRUE);
+    probe_id = gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, frame_probe, NULL, NULL);
+
+    __android_log_print(ANDROID_LOG_VERBOSE, "PiRover", "Latency measurement attached.");
+}
+
+/* The stream is being restarted, don't carry anything over to the new one */
+void latency_reset(void)
+{
+    g_atomic_int_set(&reset_requested, TRUE);
+}
+
+/* Stop watching frames and release the pad */
+void latency_detach(void)
+{
+    if (!sink_pad)
+        return;
+
+    gst_pad_remove_probe(sink_pad, probe_id);
+    gst_object_unref(sink_pad);
+    sink_pad = NULL;
+}
@@ -0,0 +1,3 @@
+void latency_attach(GstPad *pad, const char *pipeline_mode);
+void latency_reset(void);
+void latency_detach(void);
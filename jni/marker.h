@@ -0,0 +1,32 @@
+/* marker.h -- latency marker drawn by the simulator and found by the app
+ *
+ * The simulator draws a white square on a black frame. Its horizontal position follows the left motor and
+ * its vertical position the right motor, so the app can tell which control state a decoded frame reflects.
+ */
+
+#define MARKER_FRAME_WIDTH 320
+#define MARKER_FRAME_HEIGHT 240
+#define MARKER_SIZE 16
+
+/* Largest magnitude motor_speed() produces */
+#define MARKER_SPEED_MAX 4700
+
+/* Motor values are sent as sign and magnitude */
+static inline int marker_speed(unsigned short m)
+{
+    int n = (m & 0x8000) ? -(int)(m & 0x7fff) : (int)m;
+    if (n > MARKER_SPEED_MAX) n = MARKER_SPEED_MAX;
+    if (n < -MARKER_SPEED_MAX) n = -MARKER_SPEED_MAX;
+    return n;
+}
+
+/* Top left corner of the marker for the given motor values */
+static inline int marker_x(unsigned short left)
+{
+    return (marker_speed(left) + MARKER_SPEED_MAX) * (MARKER_FRAME_WIDTH - MARKER_SIZE) / (2 * MARKER_SPEED_MAX);
+}
+
+static inline int marker_y(unsigned short right)
+{
+    return (marker_speed(right) + MARKER_SPEED_MAX) * (MARKER_FRAME_HEIGHT - MARKER_SIZE) / (2 * MARKER_SPEED_MAX);
+}
@@ -62,7 +62,7 @@ void net_start(GMainContext *context)
 
     __android_log_print(ANDROID_LOG_VERBOSE, "PiRover", "Network code init.");
 
-    GSource *source = g_timeout_source_new(100);
+    GSource *source = g_timeout_source_new(NET_SEND_INTERVAL_MS);
     g_source_set_callback(source, send_controls, NULL, NULL);
     g_source_attach(source, context);
 
@@ -1,2 +1,5 @@
+/* Control packets are sent on a fixed timer */
+#define NET_SEND_INTERVAL_MS 100
+
 void net_start(GMainContext *context);
 void net_stop(void);
@@ -11,6 +11,9 @@
 
 #include "net.h"
 #include "control.h"
+#ifdef PIROVERA_LATENCY
+#include "latency.h"
+#endif
 
 GST_DEBUG_CATEGORY_STATIC (debug_category);
 #define GST_CAT_DEFAULT debug_category
@@ -31,6 +34,18 @@ GST_DEBUG_CATEGORY_STATIC (debug_category);
  * confuse some demuxers. */
 #define SEEK_MIN_DELAY (500 * GST_MSECOND)
 
+/* Stream recovery. The watchdog runs on the main loop and declares a stall when no frames have reached the
+ * video sink for STALL_TIMEOUT_MS while we want to be playing. A new connection gets RESTART_GRACE_MS to deliver
+ * its first frame instead, to cover the RTSP handshake, the jitterbuffer and waiting for a keyframe. Restarts
+ * bounce the pipeline through READY, and are retried with exponential backoff bounded by
+ * RECOVERY_BACKOFF_MAX_MS. After RECOVERY_MAX_ATTEMPTS we give up and stop the pipeline. */
+#define WATCHDOG_INTERVAL_MS 100
+#define STALL_TIMEOUT_MS 1000
+#define RESTART_GRACE_MS 3000
+#define RECOVERY_BACKOFF_MIN_MS 100
+#define RECOVERY_BACKOFF_MAX_MS 2000
+#define RECOVERY_MAX_ATTEMPTS 30
+
 /* Structure to contain all our information, so we can pass it to callbacks */
 typedef struct _CustomData {
   jobject app;                  /* Application instance, used to call its methods. A global reference is kept. */
@@ -42,6 +57,17 @@ typedef struct _CustomData {
   GstState state;               /* Current pipeline state */
   GstState target_state;        /* Desired pipeline state, to be set once buffering is complete */
   gboolean is_live;             /* Live streams do not use buffering */
+  GstElement *source;           /* The RTSP source created by playbin, to tell its errors apart */
+  GstPad *sink_pad;             /* Video sink pad watched for frames */
+  gulong sink_probe_id;         /* Probe on sink_pad */
+  gint frame_seen;              /* Set (atomically) by the sink pad probe, cleared by the watchdog */
+  gboolean got_frame;           /* A frame has reached the sink since the last (re)start */
+  gboolean restarting;          /* Pipeline is being bounced through READY, keep is_live */
+  gint64 last_buffer_time;      /* Monotonic time the watchdog last saw frames reaching the sink */
+  gint64 restart_time;          /* Monotonic time of the last start or restart attempt */
+  gint64 stall_time;            /* Monotonic time the current outage was detected, 0 if the stream is healthy */
+  guint recovery_attempts;      /* Restarts attempted during the current outage */
+  GSource *recovery_source;     /* Pending restart timeout, NULL if none is scheduled */
 } CustomData;
 
 /* playbin2 flags */
@@ -100,13 +126,53 @@ static JNIEnv *get_jni_env (void) {
 /* Forward declaration for the delayed seek callback */
 static gboolean delayed_seek_cb (CustomData *data);
 
-/* Retrieve errors from the bus and show them on the UI */
+/* Forward declarations for the recovery scheduler */
+static gboolean schedule_recovery (CustomData *data, const gchar *reason);
+static void stop_recovery (CustomData *data);
+
+/* Errors a reconnect can fix: the source failing to reach the server, or losing it. Anything else (missing
+ * plugins, codec or negotiation errors, a bad URI) will just happen again. */
+static gboolean is_transient_error (CustomData *data, GstMessage *msg, GError *err) {
+  if (!data->source || !gst_object_has_as_ancestor (GST_MESSAGE_SRC (msg), GST_OBJECT (data->source)))
+    return FALSE;
+  if (err->domain != GST_RESOURCE_ERROR)
+    return FALSE;
+
+  switch (err->code) {
+    case GST_RESOURCE_ERROR_BUSY:
+    case GST_RESOURCE_ERROR_OPEN_READ:
+    case GST_RESOURCE_ERROR_OPEN_WRITE:
+    case GST_RESOURCE_ERROR_OPEN_READ_WRITE:
+    case GST_RESOURCE_ERROR_READ:
+    case GST_RESOURCE_ERROR_WRITE:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/* Retrieve errors from the bus and try to recover from them. Stop the pipeline if we can't. */
 static void error_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
-  gst_element_set_state (data->pipeline, GST_STATE_NULL);
+  GError *err;
+  gchar *debug_info;
+  gboolean transient;
+
+  gst_message_parse_error (msg, &err, &debug_info);
+  GST_WARNING ("Error received from element %s: %s", GST_OBJECT_NAME (msg->src), err->message);
+  transient = is_transient_error (data, msg, err);
+  g_clear_error (&err);
+  g_free (debug_info);
+
+  if (!transient || !schedule_recovery (data, "error"))
+    stop_recovery (data);
 }
 
-/* Called when the End Of the Stream is reached. Just move to the beginning of the media and pause. */
+/* Called when the End Of the Stream is reached. A live stream only ends when the server goes away, so try to
+ * reconnect. Otherwise just pause. */
 static void eos_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
+  if (data->is_live && schedule_recovery (data, "end of stream"))
+    return;
+
   data->target_state = GST_STATE_PAUSED;
   data->is_live |= (gst_element_set_state (data->pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_NO_PREROLL);
 }
@@ -135,18 +201,36 @@ static void clock_lost_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
   }
 }
 
+/* Retrieve the pad at the entrance of the video sink. Returns NULL if playbin has not created the sink yet. */
+static GstPad *get_video_sink_pad (CustomData *data) {
+  GstElement *video_sink;
+  GstPad *pad;
+
+  g_object_get (data->pipeline, "video-sink", &video_sink, NULL);
+  if (!video_sink)
+    return NULL;
+  pad = gst_element_get_static_pad (video_sink, "sink");
+  gst_object_unref (video_sink);
+
+  return pad;
+}
+
 /* Retrieve the video sink's Caps and tell the application about the media size */
 static void check_media_size (CustomData *data) {
   JNIEnv *env = get_jni_env ();
-  GstElement *video_sink;
   GstPad *video_sink_pad;
   GstCaps *caps;
   GstVideoInfo info;
 
   /* Retrieve the Caps at the entrance of the video sink */
-  g_object_get (data->pipeline, "video-sink", &video_sink, NULL);
-  video_sink_pad = gst_element_get_static_pad (video_sink, "sink");
+  video_sink_pad = get_video_sink_pad (data);
+  if (!video_sink_pad)
+    return;
   caps = gst_pad_get_current_caps (video_sink_pad);
+  if (!caps) {
+    gst_object_unref (video_sink_pad);
+    return;
+  }
 
   if (gst_video_info_from_caps(&info, caps)) {
     info.width = info.width * info.par_n / info.par_d;
@@ -161,7 +245,39 @@ static void check_media_size (CustomData *data) {
 
   gst_caps_unref(caps);
   gst_object_unref (video_sink_pad);
-  gst_object_unref(video_sink);
+}
+
+/* Note that frames are reaching the sink. Called from streaming threads, so only touch the atomic flag. */
+static GstPadProbeReturn sink_buffer_probe (GstPad *pad, GstPadProbeInfo *info, CustomData *data) {
+  g_atomic_int_set (&data->frame_seen, TRUE);
+  return GST_PAD_PROBE_OK;
+}
+
+/* Watch the video sink's pad, so the recovery watchdog knows frames are getting all the way through. A live
+ * stream reaches PLAYING before the sink exists, so the watchdog keeps calling this until it finds one. */
+static void watch_video_sink (CustomData *data) {
+  GstPad *pad;
+
+  pad = get_video_sink_pad (data);
+  if (!pad)
+    return;
+
+  if (pad == data->sink_pad) {
+    gst_object_unref (pad);
+    return;
+  }
+
+  if (data->sink_pad) {
+    gst_pad_remove_probe (data->sink_pad, data->sink_probe_id);
+    gst_object_unref (data->sink_pad);
+  }
+
+  data->sink_pad = pad;
+  data->sink_probe_id = gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) sink_buffer_probe, data, NULL);
+#ifdef PIROVERA_LATENCY
+  latency_attach (pad, "playbin");
+#endif
 }
 
 /* Notify UI about pipeline state changes */
@@ -172,14 +288,22 @@ static void state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
   if (GST_MESSAGE_SRC (msg) == GST_OBJECT (data->pipeline)) {
     data->state = new_state;
 
-    if (new_state == GST_STATE_NULL || new_state == GST_STATE_READY)
+    /* A recovery bounce goes through READY, but it is still the same live stream */
+    if ((new_state == GST_STATE_NULL || new_state == GST_STATE_READY) && !data->restarting)
       data->is_live = FALSE;
+    if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED)
+      data->restarting = FALSE;
 
     /* The Ready to Paused state change is particularly interesting: */
     if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) {
       /* By now the sink already knows the media size */
       check_media_size(data);
+      watch_video_sink(data);
     }
+
+    /* Live pipelines may not have their sink set up until they start playing */
+    if (new_state == GST_STATE_PLAYING)
+      watch_video_sink(data);
   }
 }
 
@@ -205,6 +329,117 @@ static void check_initialization_complete (CustomData *data) {
 static void source_setup (GstElement *pipeline, GstElement *source, CustomData *data) {
   g_print ("Source has been created. Configuring.\n");
   g_object_set (source, "latency", 50, NULL);
+  gst_object_replace ((GstObject **) &data->source, GST_OBJECT (source));
+}
+
+/* Restart the stream by bouncing the pipeline through READY. This reconnects to the server and flushes the
+ * sinks, which matters after EOS. playsink keeps its sink and the native window across the bounce. Control
+ * packets are sent from their own timer and keep flowing throughout. */
+static gboolean recovery_cb (CustomData *data) {
+  data->recovery_source = NULL;
+  data->recovery_attempts++;
+
+  if (data->target_state < GST_STATE_PLAYING || !data->native_window)
+    return FALSE;
+
+  GST_INFO ("Restarting pipeline (attempt %u)", data->recovery_attempts);
+  data->restarting = TRUE;
+#ifdef PIROVERA_LATENCY
+  latency_reset ();
+#endif
+  gst_element_set_state (data->pipeline, GST_STATE_READY);
+  data->is_live |= (gst_element_set_state (data->pipeline, data->target_state) == GST_STATE_CHANGE_NO_PREROLL);
+
+  /* Give the new connection the grace period to deliver its first frame */
+  data->restart_time = g_get_monotonic_time ();
+  data->got_frame = FALSE;
+  return FALSE;
+}
+
+/* Give up on the stream and stop the pipeline. It stays stopped until the app asks to play again. */
+static void stop_recovery (CustomData *data) {
+  if (data->recovery_source) {
+    g_source_destroy (data->recovery_source);
+    data->recovery_source = NULL;
+  }
+  data->stall_time = 0;
+  data->recovery_attempts = 0;
+  data->target_state = GST_STATE_NULL;
+  gst_element_set_state (data->pipeline, GST_STATE_NULL);
+}
+
+/* Schedule a restart, unless one is already pending. The delay doubles with each failed attempt. Returns
+ * FALSE if we are not trying to play, have nowhere to show the video, or have run out of attempts. */
+static gboolean schedule_recovery (CustomData *data, const gchar *reason) {
+  guint delay;
+
+  if (data->target_state < GST_STATE_PLAYING || !data->native_window)
+    return FALSE;
+
+  if (data->recovery_source)
+    return TRUE;
+
+  if (data->recovery_attempts >= RECOVERY_MAX_ATTEMPTS) {
+    GST_ERROR ("Stream lost (%s), giving up after %u attempts", reason, data->recovery_attempts);
+    return FALSE;
+  }
+
+  if (!data->stall_time)
+    data->stall_time = g_get_monotonic_time ();
+
+  delay = RECOVERY_BACKOFF_MIN_MS << MIN (data->recovery_attempts, 8);
+  delay = MIN (delay, RECOVERY_BACKOFF_MAX_MS);
+  GST_WARNING ("Stream lost (%s), restarting in %u ms", reason, delay);
+
+  data->recovery_source = g_timeout_source_new (delay);
+  g_source_set_callback (data->recovery_source, (GSourceFunc) recovery_cb, data, NULL);
+  g_source_attach (data->recovery_source, data->context);
+  g_source_unref (data->recovery_source);
+  return TRUE;
+}
+
+/* Periodically check that frames are still reaching the sink, and report how long it took to get them back
+ * after an outage. The restart figure is the time from the restart that worked to the first frame on screen,
+ * which is what recovery costs once the link is back, without the stall timeout and backoff. */
+static gboolean watchdog_cb (CustomData *data) {
+  gint64 now = g_get_monotonic_time ();
+  gint64 deadline;
+
+  if (!data->sink_pad)
+    watch_video_sink (data);
+
+  if (g_atomic_int_compare_and_exchange (&data->frame_seen, TRUE, FALSE)) {
+    if (data->stall_time) {
+      GST_INFO ("Stream recovered: restart took %" G_GINT64_FORMAT " ms, video was lost for %" G_GINT64_FORMAT
+          " ms, outage detected %" G_GINT64_FORMAT " ms ago, %u attempts",
+          data->recovery_attempts ? (now - data->restart_time) / 1000 : 0,
+          (now - data->last_buffer_time) / 1000, (now - data->stall_time) / 1000, data->recovery_attempts);
+      data->stall_time = 0;
+      data->recovery_attempts = 0;
+    }
+    data->last_buffer_time = now;
+    data->got_frame = TRUE;
+    return TRUE;
+  }
+
+  /* Nothing is expected to flow when we are not playing, or while there is no window to play into. Playing
+   * from here on counts as a fresh start. */
+  if (data->target_state < GST_STATE_PLAYING || !data->native_window) {
+    data->last_buffer_time = now;
+    data->restart_time = now;
+    data->got_frame = FALSE;
+    return TRUE;
+  }
+
+  if (data->got_frame)
+    deadline = data->last_buffer_time + STALL_TIMEOUT_MS * G_GINT64_CONSTANT (1000);
+  else
+    deadline = data->restart_time + RESTART_GRACE_MS * G_GINT64_CONSTANT (1000);
+
+  if (now > deadline && !schedule_recovery (data, "stalled"))
+    stop_recovery (data);
+
+  return TRUE;
 }
 
 /* Main method for the native code. This is executed on its own thread. */
@@ -257,6 +492,13 @@ static void *app_function (void *userdata) {
   g_signal_connect (G_OBJECT (bus), "message::clock-lost", (GCallback)clock_lost_cb, data);
   gst_object_unref (bus);
 
+  /* Watch for stalls so we can recover from link drops */
+  data->last_buffer_time = g_get_monotonic_time ();
+  timeout_source = g_timeout_source_new (WATCHDOG_INTERVAL_MS);
+  g_source_set_callback (timeout_source, (GSourceFunc) watchdog_cb, data, NULL);
+  g_source_attach (timeout_source, data->context);
+  g_source_unref (timeout_source);
+
   /* Create a GLib Main Loop and set it to run */
   GST_DEBUG ("Entering main loop... (CustomData:%p)", data);
   data->main_loop = g_main_loop_new (data->context, FALSE);
@@ -270,8 +512,14 @@ static void *app_function (void *userdata) {
   net_stop();
   g_main_context_pop_thread_default(data->context);
   g_main_context_unref (data->context);
+  data->recovery_source = NULL;
   data->target_state = GST_STATE_NULL;
   gst_element_set_state (data->pipeline, GST_STATE_NULL);
+#ifdef PIROVERA_LATENCY
+  latency_detach ();
+#endif
+  gst_object_replace ((GstObject **) &data->source, NULL);
+  gst_object_replace ((GstObject **) &data->sink_pad, NULL);
   gst_object_unref (data->pipeline);
 
   return NULL;
@@ -0,0 +1,309 @@
+/* roversim.c -- simulate the rover end of the link on a desktop machine
+ *
+ * Copyright (C) 2015 Alistair Buxton <a.j.buxton@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Serves a test video stream on rtsp://<host>:8554/test and listens for control packets on UDP port 5005,
+ * the same as the real rover. Give the machine running it the rover's address (172.24.1.1) on the phone's
+ * network and the app will connect to it unmodified.
+ *
+ * The stream can be cut and restored on a schedule to exercise the app's recovery. While the stream is cut
+ * the payloader drops everything, which looks like a WiFi dropout. With --drop-clients the RTSP sessions are
+ * also torn down, which looks like the link going away completely. Cut and restore times are printed. When
+ * the app starts playing again after a restore, the time since the restore is printed too; this only shows up
+ * with --drop-clients, because otherwise the app's session survives and it never asks to play again. In both
+ * cases the app logs "Stream recovered: restart took N ms", the time from the restart that worked to the
+ * first frame reaching its video sink.
+ *
+ * The video shows the marker from marker.h, positioned according to the last control packet received. An
+ * app built with PIROVERA_LATENCY finds it in the decoded frames to measure command to photon latency.
+ *
+ * Build with:
+ *   gcc -I../jni -o roversim roversim.c \
+ *       $(pkg-config --cflags --libs gstreamer-rtsp-server-1.0 gstreamer-video-1.0 gio-2.0)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include "marker.h"
+
+#define DEFAULT_RTSP_PORT "8554"
+#define DEFAULT_CONTROL_PORT 5005
+
+static char *rtsp_port = (char *) DEFAULT_RTSP_PORT;
+static int control_port = DEFAULT_CONTROL_PORT;
+static int cut_after = 0;
+static int cut_every = 0;
+static int cut_for = 2000;
+static gboolean drop_clients = FALSE;
+static gboolean quiet = FALSE;
+
+static GOptionEntry entries[] = {
+    {"port", 'p', 0, G_OPTION_ARG_STRING, &rtsp_port,
+        "RTSP port to listen on (default: " DEFAULT_RTSP_PORT ")", "PORT"},
+    {"control-port", 'c', 0, G_OPTION_ARG_INT, &control_port,
+        "UDP port to receive control packets on (default: 5005)", "PORT"},
+    {"cut-after", 0, 0, G_OPTION_ARG_INT, &cut_after,
+        "Cut the stream this many seconds after startup (default: never)", "SECONDS"},
+    {"cut-every", 0, 0, G_OPTION_ARG_INT, &cut_every,
+        "Cut the stream again every this many seconds (default: only once)", "SECONDS"},
+    {"cut-for", 0, 0, G_OPTION_ARG_INT, &cut_for,
+        "Length of each cut (default: 2000)", "MS"},
+    {"drop-clients", 0, 0, G_OPTION_ARG_NONE, &drop_clients,
+        "Also close the RTSP sessions when cutting the stream", NULL},
+    {"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+        "Don't print every control packet", NULL},
+    {NULL}
+};
+
+static GstRTSPServer *server;
+static gint stream_cut = FALSE;
+static gint left_motor = 0;
+static gint right_motor = 0;
+static gint64 start_time;
+static gint64 restore_time = 0;
+
+static gint64 elapsed_ms(void)
+{
+    return (g_get_monotonic_time() - start_time) / 1000;
+}
+
+/* Runs in the streaming thread, so only look at the atomic flag. */
+static GstPadProbeReturn cut_probe(GstPad *pad, GstPadProbeInfo *info, gpointer unused)
+{
+    return g_atomic_int_get(&stream_cut) ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+/* Draw the marker where the motor values say it should be. Runs in the streaming thread. */
+static GstPadProbeReturn marker_probe(GstPad *pad, GstPadProbeInfo *info, gpointer unused)
+{
+    GstBuffer *buffer;
+    GstCaps *caps;
+    GstVideoInfo vinfo;
+    GstVideoFrame frame;
+    guint8 *luma;
+    int stride, x0, y0, y;
+
+    caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        return GST_PAD_PROBE_OK;
+    if (!gst_video_info_from_caps(&vinfo, caps)) {
+        gst_caps_unref(caps);
+        return GST_PAD_PROBE_OK;
+    }
+    gst_caps_unref(caps);
+
+    buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+
+    if (!gst_video_frame_map(&frame, &vinfo, buffer, GST_MAP_WRITE))
+        return GST_PAD_PROBE_OK;
+
+    luma = GST_VIDEO_FRAME_COMP_DATA(&frame, 0);
+    stride = GST_VIDEO_FRAME_COMP_STRIDE(&frame, 0);
+    x0 = marker_x(g_atomic_int_get(&left_motor));
+    y0 = marker_y(g_atomic_int_get(&right_motor));
+
+    for (y = y0; y < y0 + MARKER_SIZE; y++)
+        memset(luma + y * stride + x0, 235, MARKER_SIZE);
+
+    gst_video_frame_unmap(&frame);
+    return GST_PAD_PROBE_OK;
+}
+
+static void media_configure(GstRTSPMediaFactory *factory, GstRTSPMedia *media, gpointer unused)
+{
+    GstElement *element, *pay, *marker;
+    GstPad *pad;
+
+    element = gst_rtsp_media_get_element(media);
+
+    marker = gst_bin_get_by_name(GST_BIN(element), "marker");
+    pad = gst_element_get_static_pad(marker, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, marker_probe, NULL, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(marker);
+
+    pay = gst_bin_get_by_name(GST_BIN(element), "pay0");
+    pad = gst_element_get_static_pad(pay, "src");
+
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+            cut_probe, NULL, NULL);
+
+    gst_object_unref(pad);
+    gst_object_unref(pay);
+    gst_object_unref(element);
+}
+
+static GstRTSPFilterResult remove_client(GstRTSPServer *server, GstRTSPClient *client, gpointer unused)
+{
+    return GST_RTSP_FILTER_REMOVE;
+}
+
+static void client_play(GstRTSPClient *client, GstRTSPContext *ctx, gpointer unused)
+{
+    if (restore_time && !g_atomic_int_get(&stream_cut))
+        printf("%8" G_GINT64_FORMAT " client playing %" G_GINT64_FORMAT " ms after restore\n",
+                elapsed_ms(), elapsed_ms() - restore_time);
+}
+
+static void client_connected(GstRTSPServer *server, GstRTSPClient *client, gpointer unused)
+{
+    g_signal_connect(client, "play-request", G_CALLBACK(client_play), NULL);
+}
+
+static gboolean restore_stream(gpointer unused)
+{
+    g_atomic_int_set(&stream_cut, FALSE);
+    restore_time = elapsed_ms();
+    printf("%8" G_GINT64_FORMAT " stream restored\n", elapsed_ms());
+    return FALSE;
+}
+
+static gboolean cut_stream(gpointer unused)
+{
+    g_atomic_int_set(&stream_cut, TRUE);
+    printf("%8" G_GINT64_FORMAT " stream cut for %d ms\n", elapsed_ms(), cut_for);
+
+    if (drop_clients)
+        gst_rtsp_server_client_filter(server, remove_client, NULL);
+
+    g_timeout_add(cut_for, restore_stream, NULL);
+    return FALSE;
+}
+
+static gboolean cut_stream_repeat(gpointer unused)
+{
+    cut_stream(NULL);
+    return TRUE;
+}
+
+static gboolean first_cut(gpointer unused)
+{
+    cut_stream(NULL);
+    if (cut_every > 0)
+        g_timeout_add_seconds(cut_every, cut_stream_repeat, NULL);
+    return FALSE;
+}
+
+static gboolean receive_controls(GSocket *socket, GIOCondition condition, gpointer unused)
+{
+    guint8 buf[12];
+    gssize len;
+
+    len = g_socket_receive(socket, (gchar *) buf, sizeof(buf), NULL, NULL);
+    if (len != sizeof(buf))
+        return TRUE;
+
+    /* Right motors are 0 and 2, left are 1 and 3, see control.c */
+    g_atomic_int_set(&right_motor, (buf[0] << 8) | buf[1]);
+    g_atomic_int_set(&left_motor, (buf[2] << 8) | buf[3]);
+
+    if (quiet)
+        return TRUE;
+
+    printf("%8" G_GINT64_FORMAT " %s %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
+            elapsed_ms(), g_atomic_int_get(&stream_cut) ? "cut" : "   ",
+            buf[0], buf[1], buf[2], buf[3],
+            buf[4], buf[5], buf[6], buf[7],
+            buf[8], buf[9], buf[10], buf[11]);
+    return TRUE;
+}
+
+static void control_start(void)
+{
+    GSocket *socket;
+    GInetAddress *udpAddress;
+    GSocketAddress *udpSocketAddress;
+    GSource *source;
+    GError *err = NULL;
+
+    socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &err);
+    g_assert(err == NULL);
+
+    udpAddress = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+    udpSocketAddress = g_inet_socket_address_new(udpAddress, control_port);
+
+    g_socket_bind(socket, udpSocketAddress, TRUE, &err);
+    g_assert(err == NULL);
+
+    g_object_unref(udpSocketAddress);
+    g_object_unref(udpAddress);
+
+    source = g_socket_create_source(socket, G_IO_IN, NULL);
+    g_source_set_callback(source, (GSourceFunc) receive_controls, NULL, NULL);
+    g_source_attach(source, NULL);
+    g_source_unref(source);
+}
+
+int main(int argc, char *argv[])
+{
+    GMainLoop *loop;
+    GstRTSPMountPoints *mounts;
+    GstRTSPMediaFactory *factory;
+    GOptionContext *optctx;
+    GError *error = NULL;
+
+    optctx = g_option_context_new("- Pi Rover simulator");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        g_printerr("Error parsing options: %s\n", error->message);
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+
+    loop = g_main_loop_new(NULL, FALSE);
+    start_time = g_get_monotonic_time();
+
+    server = gst_rtsp_server_new();
+    g_object_set(server, "service", rtsp_port, NULL);
+
+    factory = gst_rtsp_media_factory_new();
+    gst_rtsp_media_factory_set_launch(factory,
+            "( videotestsrc is-live=true pattern=black ! "
+            "video/x-raw,format=I420,width=" G_STRINGIFY(MARKER_FRAME_WIDTH) ",height="
+            G_STRINGIFY(MARKER_FRAME_HEIGHT) ",framerate=30/1 ! identity name=marker ! "
+            "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=30 ! "
+            "rtph264pay name=pay0 pt=96 config-interval=1 )");
+    gst_rtsp_media_factory_set_shared(factory, TRUE);
+    g_signal_connect(factory, "media-configure", G_CALLBACK(media_configure), NULL);
+
+    mounts = gst_rtsp_server_get_mount_points(server);
+    gst_rtsp_mount_points_add_factory(mounts, "/test", factory);
+    g_object_unref(mounts);
+
+    g_signal_connect(server, "client-connected", G_CALLBACK(client_connected), NULL);
+    gst_rtsp_server_attach(server, NULL);
+    control_start();
+
+    if (cut_after > 0)
+        g_timeout_add_seconds(cut_after, first_cut, NULL);
+
+    printf("stream ready at rtsp://127.0.0.1:%s/test, controls on udp port %d\n", rtsp_port, control_port);
+    g_main_loop_run(loop);
+
+    return 0;
+}